@@ -3,19 +3,24 @@
 #include <algorithm>
 #include <assert.h>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <cstdarg>
 #include <cstring>
 #include <dirent.h>
 #include <dlfcn.h>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <mutex>
 #include <optional>
 #include <pthread.h>
 #include <random>
 #include <signal.h>
 #include <sstream>
+#include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,7 +43,11 @@
 #include <unistd.h>
 #endif
 
+#include <poll.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 /** maximum size of stack trace arrays */
 const int MAX_DEPTH = 1024;
@@ -106,16 +115,51 @@ std::recursive_mutex
     threadToJavaIdMutex; // hold this mutex while working with threadToJavaId
 std::unordered_map<pthread_t, jlong> threadToJavaId;
 
+struct ThreadRecord;
+/** per thread statistics of each thread in threadToJavaId (if available) */
+std::unordered_map<pthread_t, ThreadRecord *> threadToRecord;
+
+ThreadRecord *allocateThreadRecord(JNIEnv *jni_env, jthread thread,
+                                   jlong javaId, const char *name);
+
+void releaseThreadRecord(JNIEnv *jni_env, ThreadRecord *record);
+
 struct ThreadState {
   pthread_t thread;
 };
 
+/** kind of the Java thread that is running on a sampled native thread */
+enum class ThreadKind { PLATFORM, VIRTUAL };
+
+/** true if the JVM supports virtual threads and we track them */
+static bool virtualThreadsEnabled = false;
+
+/** record of the current platform thread, set in OnThreadStart */
+thread_local ThreadRecord *currentThreadRecord = nullptr;
+
+/** sets the Java id of the virtual thread mounted on the current (carrier)
+ * thread, 0 if none */
+void setMountedVirtualThread(jlong javaId);
+
+/** returns the Java id of the virtual thread mounted on the thread or -1 */
+jlong mountedVirtualThread(ThreadRecord *record);
+
+/** Thread.getId, looked up in OnVMInit */
+std::atomic<jmethodID> threadGetIdMethod(nullptr);
+
+jmethodID lookupThreadGetIdMethod(JNIEnv *env) {
+  jclass threadClass = env->FindClass("java/lang/Thread");
+  return env->GetMethodID(threadClass, "getId", "()J");
+}
+
 jlong obtainJavaThreadIdViaJava(JNIEnv *env, jthread thread) {
   if (env == nullptr) {
     return -1;
   }
-  jclass threadClass = env->FindClass("java/lang/Thread");
-  jmethodID getId = env->GetMethodID(threadClass, "getId", "()J");
+  jmethodID getId = threadGetIdMethod;
+  if (getId == nullptr) { // thread started before VMInit
+    getId = lookupThreadGetIdMethod(env);
+  }
   jlong id = env->CallLongMethod(thread, getId);
   return id;
 }
@@ -147,6 +191,8 @@ static void sampleLoop();
 
 std::thread samplerThread;
 
+std::thread controlThread;
+
 void printInfo();
 
 void printInfoIfNeeded();
@@ -156,24 +202,131 @@ void onAbort() {
   if (samplerThread.joinable()) {
     samplerThread.join();
   }
+  if (controlThread.joinable()) {
+    controlThread.join();
+  }
 }
 
 void OnThreadStart(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread thread) {
+  jlong javaId = obtainJavaThreadIdViaJava(jni_env, thread);
+  jvmtiThreadInfo info;
+  memset(&info, 0, sizeof(info));
+  jvmti_env->GetThreadInfo(thread, &info);
+  ThreadRecord *record =
+      allocateThreadRecord(jni_env, thread, javaId,
+                           info.name != nullptr ? info.name : "");
+  jvmti_env->Deallocate((unsigned char *)info.name);
   {
     std::lock_guard<std::recursive_mutex> lock(threadToJavaIdMutex);
-    threadToJavaId.emplace(get_thread_id(),
-                           obtainJavaThreadIdViaJava(jni_env, thread));
+    threadToJavaId.emplace(get_thread_id(), javaId);
+    if (record != nullptr) {
+      threadToRecord.emplace(get_thread_id(), record);
+    }
   }
+  currentThreadRecord = record;
   jvmti_env->SetThreadLocalStorage(
       thread, new ThreadState({(pthread_t)get_thread_id()}));
 }
 
 void OnThreadEnd(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread thread) {
+  currentThreadRecord = nullptr;
   std::lock_guard<std::recursive_mutex> lock(threadToJavaIdMutex);
   threadToJavaId.erase(get_thread_id());
+  auto record = threadToRecord.find(get_thread_id());
+  if (record != threadToRecord.end()) {
+    releaseThreadRecord(jni_env, record->second);
+    threadToRecord.erase(record);
+  }
   printInfoIfNeeded();
 }
 
+/** marks the current (carrier) thread as running the virtual thread */
+void mountVirtualThread(jvmtiEnv *jvmti_env, jthread vthread) {
+  void *javaId = nullptr;
+  jvmti_env->GetThreadLocalStorage(vthread, &javaId);
+  if (javaId != nullptr) {
+    setMountedVirtualThread((jlong)(intptr_t)javaId);
+  }
+}
+
+// virtual thread events are posted on the carrier thread while the virtual
+// thread is mounted, the thread local storage of a virtual thread directly
+// stores its (positive) Java id to avoid allocations
+void JNICALL OnVirtualThreadStart(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
+                                  jthread vthread) {
+  jvmti_env->SetThreadLocalStorage(
+      vthread, (void *)(intptr_t)obtainJavaThreadIdViaJava(jni_env, vthread));
+  mountVirtualThread(jvmti_env, vthread);
+}
+
+void JNICALL OnVirtualThreadEnd(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
+                                jthread vthread) {
+  setMountedVirtualThread(0);
+}
+
+// HotSpot specific extension events, without them we only know about the
+// first mount (start) and the last unmount (end) of every virtual thread.
+// HotSpot calls them as jvmtiExtensionEvent, so they have to be variadic:
+// (jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread vthread)
+void JNICALL OnVirtualThreadMount(jvmtiEnv *jvmti_env, ...) {
+  va_list args;
+  va_start(args, jvmti_env);
+  va_arg(args, JNIEnv *);
+  jthread vthread = va_arg(args, jthread);
+  va_end(args);
+  mountVirtualThread(jvmti_env, vthread);
+}
+
+void JNICALL OnVirtualThreadUnmount(jvmtiEnv *jvmti_env, ...) {
+  setMountedVirtualThread(0);
+}
+
+/** enables the extension event with the given id, returns true on success */
+bool enableExtensionEvent(const char *id, jvmtiExtensionEvent callback) {
+  jint count = 0;
+  JvmtiDeallocator<jvmtiExtensionEventInfo *> events;
+  if (jvmti->GetExtensionEvents(&count, events.get_addr()) !=
+      JVMTI_ERROR_NONE) {
+    return false;
+  }
+  bool found = false;
+  for (int i = 0; i < count; i++) {
+    jvmtiExtensionEventInfo &event = events.get()[i];
+    if (!found && strcmp(event.id, id) == 0) {
+      found = jvmti->SetExtensionEventCallback(event.extension_event_index,
+                                               callback) == JVMTI_ERROR_NONE;
+    }
+    for (int j = 0; j < event.param_count; j++) {
+      jvmti->Deallocate((unsigned char *)event.params[j].name);
+    }
+    jvmti->Deallocate((unsigned char *)event.params);
+    jvmti->Deallocate((unsigned char *)event.id);
+    jvmti->Deallocate((unsigned char *)event.short_description);
+  }
+  return found;
+}
+
+/** enable the virtual thread events, requires can_support_virtual_threads */
+void enableVirtualThreadEvents() {
+  if (jvmti->SetEventNotificationMode(JVMTI_ENABLE,
+                                      JVMTI_EVENT_VIRTUAL_THREAD_START,
+                                      nullptr) != JVMTI_ERROR_NONE ||
+      jvmti->SetEventNotificationMode(JVMTI_ENABLE,
+                                      JVMTI_EVENT_VIRTUAL_THREAD_END,
+                                      nullptr) != JVMTI_ERROR_NONE) {
+    fprintf(stderr, "Could not enable virtual thread events\n");
+    virtualThreadsEnabled = false;
+    return;
+  }
+  if (!enableExtensionEvent("com.sun.hotspot.events.VirtualThreadMount",
+                            &OnVirtualThreadMount) ||
+      !enableExtensionEvent("com.sun.hotspot.events.VirtualThreadUnmount",
+                            &OnVirtualThreadUnmount)) {
+    fprintf(stderr, "Virtual thread mount events not available, only the "
+                    "first mount of each virtual thread is tracked\n");
+  }
+}
+
 static void GetJMethodIDs(jclass klass) {
   jint method_count = 0;
   JvmtiDeallocator<jmethodID *> methods;
@@ -192,8 +345,11 @@ static void JNICALL OnClassPrepare(jvmtiEnv *jvmti, JNIEnv *jni_env,
 
 static void startSamplerThread();
 
+static void startControlThread();
+
 static void JNICALL OnVMInit(jvmtiEnv *jvmti, JNIEnv *jni_env, jthread thread) {
   env = jni_env;
+  threadGetIdMethod = lookupThreadGetIdMethod(jni_env);
   jint class_count = 0;
 
   // Get any previously loaded classes that won't have gone through the
@@ -214,6 +370,7 @@ static void JNICALL OnVMInit(jvmtiEnv *jvmti, JNIEnv *jni_env, jthread thread) {
   }
 
   startSamplerThread();
+  startControlThread();
 }
 
 // A copy of the ASGCT data structures.
@@ -234,16 +391,32 @@ ASGCTType asgct;
 
 static void signalHandler(int signum, siginfo_t *info, void *ucontext);
 
+static void controlLoop();
+
 static void startSamplerThread() {
   samplerThread = std::thread(sampleLoop);
   installSignalHandler(SIGPROF, signalHandler);
 }
 
-static int maxDepth = MAX_DEPTH;
-static int printStatsEveryNthTrace = 100000;
-static int sampleIntervalInUs = 1;
-static int threadsPerInterval = 10;
+// the first options can be changed at runtime via the control socket
+static std::atomic<int> maxDepth(MAX_DEPTH);
+static std::atomic<int> printStatsEveryNthTrace(100000);
+static std::atomic<int> sampleIntervalInUs(1);
+static std::atomic<int> threadsPerInterval(10);
+static std::atomic<int> topThreads(10);
+// negative: no outlier capturing
+static std::atomic<float> outlierThresholdInUs(-1);
+static std::atomic<bool> outlierThresholdIsP99(false);
+static std::atomic<bool> paused(false);
 static bool checkThreadRunning = false;
+static bool trackVirtualThreads = true;
+static std::string controlSocketPath;
+
+static void startControlThread() {
+  if (!controlSocketPath.empty()) {
+    controlThread = std::thread(controlLoop);
+  }
+}
 
 void printHelp() {
   printf(R"(Usage: -agentpath:libagent.so=[,options]
@@ -258,7 +431,8 @@ Options:
     has to be smaller than 1024
 
   printStatsEveryNthTrace=<int> (default: 100000)
-    print statistics every n-th stack trace
+    print statistics every n-th stack trace, 0 to disable (e.g. when
+    the statistics are obtained via the control socket)
 
   sampleIntervalInUs=<int> (default: 100)
     sample interval in microseconds
@@ -266,48 +440,103 @@ Options:
   threadsPerInterval=<int> (default: 10)
     number of threads to sample per interval
 
+  topThreads=<int> (default: 10)
+    number of the slowest and most failing threads to report, 0 to disable
+
+  outlierThreshold=<float>|p99|off (default: off)
+    capture the stack trace, error code, thread state and timings of every
+    sample whose "signal handler till end" time is above the threshold in µs
+    (or above the current 99th percentile), the last 64 are reported
+
   checkThreadRunning=<bool> (default: false)
     check if the thread is currently running before sampling it, reduces performance
     but is probably broken
+
+  virtualThreads=<bool> (default: true)
+    track which virtual thread is mounted on each carrier thread and report
+    samples of virtual threads separately, requires JDK 21+
+
+  controlSocket=<path> (default: none)
+    listen on a Unix domain socket at this path for commands that change
+    the agent at runtime, send "help" over the socket for the commands
   )");
 }
 
+/** parses an int in [min, max], throws std::invalid_argument otherwise */
+int parseInt(const std::string &value, int min,
+             int max = std::numeric_limits<int>::max()) {
+  int result = std::stoi(value);
+  if (result < min || result > max) {
+    throw std::invalid_argument(value);
+  }
+  return result;
+}
+
+/** sets the option, returns false if the key is unknown or the value invalid */
+bool setOption(const std::string &key, const std::string &value) {
+  try {
+    if (key == "maxDepth") {
+      maxDepth = parseInt(value, 1, MAX_DEPTH);
+    } else if (key == "printStatsEveryNthTrace") {
+      printStatsEveryNthTrace = parseInt(value, 0);
+    } else if (key == "sampleIntervalInUs") {
+      sampleIntervalInUs = parseInt(value, 1);
+    } else if (key == "threadsPerInterval") {
+      threadsPerInterval = parseInt(value, 1);
+    } else if (key == "topThreads") {
+      topThreads = std::stoi(value);
+    } else if (key == "outlierThreshold") {
+      // parse first, so that invalid values don't change the threshold
+      bool isP99 = value == "p99";
+      float thresholdInUs = isP99 ? 0 : value == "off" ? -1 : std::stof(value);
+      if (isP99) {
+        outlierThresholdIsP99 = true;
+      } else {
+        outlierThresholdInUs = thresholdInUs;
+        outlierThresholdIsP99 = false;
+      }
+    } else if (key == "checkThreadRunning") {
+      checkThreadRunning = value == "true";
+    } else if (key == "virtualThreads") {
+      trackVirtualThreads = value == "true";
+    } else if (key == "controlSocket") {
+      controlSocketPath = value;
+    } else {
+      return false;
+    }
+  } catch (const std::exception &e) { // thrown by std::stoi and parse*
+    return false;
+  }
+  return true;
+}
+
+/** options that can be changed via the control socket */
+bool isRuntimeOption(const std::string &key) {
+  return key == "maxDepth" || key == "printStatsEveryNthTrace" ||
+         key == "sampleIntervalInUs" || key == "threadsPerInterval" ||
+         key == "topThreads" || key == "outlierThreshold";
+}
+
 void parseOptions(char *options) {
   if (options == nullptr) {
     return;
   }
 
-  char *token = strtok(options, ",");
-  std::string tokenStr = token;
-  while (token != nullptr) {
+  for (char *token = strtok(options, ","); token != nullptr;
+       token = strtok(nullptr, ",")) {
+    std::string tokenStr = token;
     if (tokenStr == "help") {
       printHelp();
       continue;
     }
     auto equalsPos = tokenStr.find("=");
-    if (equalsPos == std::string::npos) {
-      printf("Invalid option: %s\n", tokenStr.c_str());
-      printHelp();
-      exit(1);
-    }
-    auto key = tokenStr.substr(0, equalsPos);
-    auto value = tokenStr.substr(equalsPos + 1);
-    if (key == "maxDepth") {
-      maxDepth = std::stoi(value);
-    } else if (key == "printStatsEveryNthTrace") {
-      printStatsEveryNthTrace = std::stoi(value);
-    } else if (key == "sampleIntervalInUs") {
-      sampleIntervalInUs = std::stoi(value);
-    } else if (key == "threadsPerInterval") {
-      threadsPerInterval = std::stoi(value);
-    } else if (key == "checkThreadRunning") {
-      checkThreadRunning = value == "true";
-    } else {
+    if (equalsPos == std::string::npos ||
+        !setOption(tokenStr.substr(0, equalsPos),
+                   tokenStr.substr(equalsPos + 1))) {
       printf("Invalid option: %s\n", tokenStr.c_str());
       printHelp();
       exit(1);
     }
-    token = strtok(nullptr, ",");
   }
 }
 
@@ -321,6 +550,15 @@ static jint Agent_Initialize(JavaVM *_jvm, char *options, void *reserved) {
   parseOptions(options);
   jvm = _jvm;
   jint res = jvm->GetEnv((void **)&jvmti, JVMTI_VERSION);
+  if (res != JNI_OK || jvmti == nullptr) {
+    // JVMs older than the headers reject newer versions, so fall back to an
+    // older version (without virtual thread support)
+    trackVirtualThreads = false;
+    res = jvm->GetEnv((void **)&jvmti, JVMTI_VERSION_11);
+    if (res != JNI_OK || jvmti == nullptr) {
+      res = jvm->GetEnv((void **)&jvmti, JVMTI_VERSION_1_2);
+    }
+  }
   if (res != JNI_OK || jvmti == nullptr) {
     fprintf(stderr, "Error: wrong result of a valid call to GetEnv!\n");
     return JNI_ERR;
@@ -332,6 +570,15 @@ static jint Agent_Initialize(JavaVM *_jvm, char *options, void *reserved) {
   caps.can_get_line_numbers = 1;
   caps.can_get_source_file_name = 1;
 
+  jvmtiCapabilities potentialCaps;
+  memset(&potentialCaps, 0, sizeof(potentialCaps));
+  if (trackVirtualThreads &&
+      jvmti->GetPotentialCapabilities(&potentialCaps) == JVMTI_ERROR_NONE &&
+      potentialCaps.can_support_virtual_threads) {
+    caps.can_support_virtual_threads = 1;
+    virtualThreadsEnabled = true;
+  }
+
   ensureSuccess(jvmti->AddCapabilities(&caps), "AddCapabilities");
 
   jvmtiEventCallbacks callbacks;
@@ -342,6 +589,8 @@ static jint Agent_Initialize(JavaVM *_jvm, char *options, void *reserved) {
   callbacks.VMDeath = &OnVMDeath;
   callbacks.ThreadStart = &OnThreadStart;
   callbacks.ThreadEnd = &OnThreadEnd;
+  callbacks.VirtualThreadStart = &OnVirtualThreadStart;
+  callbacks.VirtualThreadEnd = &OnVirtualThreadEnd;
   ensureSuccess(
       jvmti->SetEventCallbacks(&callbacks, sizeof(jvmtiEventCallbacks)),
       "SetEventCallbacks");
@@ -363,6 +612,9 @@ static jint Agent_Initialize(JavaVM *_jvm, char *options, void *reserved) {
   ensureSuccess(jvmti->SetEventNotificationMode(
                     JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, nullptr),
                 "thread end");
+  if (virtualThreadsEnabled) {
+    enableVirtualThreadEvents();
+  }
 
   asgct = reinterpret_cast<ASGCTType>(dlsym(RTLD_DEFAULT, "AsyncGetCallTrace"));
   if (asgct == nullptr) {
@@ -566,10 +818,337 @@ public:
   size_t count() const { return overall.count(); }
 };
 
-LengthBucketStatistic asgctTimings(10);
-Statistic jniEnvTimings;
-LengthBucketStatistic asgctTimingsWithSignalHandling(10);
-Statistic asgctBrokenTimings;
+/** counts the error codes (num_frames <= 0) returned by AsyncGetCallTrace */
+class ErrorStatistic {
+  static const int MAX_ERROR = 10;
+  std::array<long, MAX_ERROR + 2> counts{}; // last slot: unknown error codes
+  long overall = 0;
+
+  static const char *name(int error) {
+    static const char *names[] = {"no Java frame",
+                                  "no class load",
+                                  "GC active",
+                                  "unknown not Java",
+                                  "not walkable not Java",
+                                  "unknown Java",
+                                  "not walkable Java",
+                                  "unknown state",
+                                  "thread exit",
+                                  "deopt",
+                                  "safepoint"};
+    return error <= MAX_ERROR ? names[error] : "other";
+  }
+
+public:
+  void push_back(long numFrames) {
+    long error = -numFrames;
+    counts.at(error >= 0 && error <= MAX_ERROR ? error : MAX_ERROR + 1)++;
+    overall++;
+  }
+
+  long count() const { return overall; }
+
+  std::string str() const {
+    std::stringstream ss;
+    ss << std::right << std::setw(7) << "code" << std::setw(24) << "error"
+       << printColumn("%") << printColumn("count", 12) << std::endl;
+    for (int i = 0; i < (int)counts.size(); i++) {
+      if (counts[i] == 0) {
+        continue;
+      }
+      ss << std::right << std::setw(7) << -i << std::setw(24) << name(i)
+         << printColumn(counts[i] * 100.0 / overall)
+         << printColumn(counts[i], 12) << std::endl;
+    }
+    return ss.str();
+  }
+};
+
+/** all statistics that are collected for one kind of thread */
+struct SampleStatistics {
+  LengthBucketStatistic<> asgctTimings{10};
+  Statistic jniEnvTimings;
+  LengthBucketStatistic<> asgctTimingsWithSignalHandling{10};
+  Statistic asgctBrokenTimings;
+  ErrorStatistic asgctErrors;
+
+  std::string str() {
+    std::stringstream ss;
+    ss << "asgct alone" << std::endl
+       << asgctTimings.str() << std::endl
+       << "signal handler till end" << std::endl
+       << asgctTimingsWithSignalHandling.str() << std::endl
+       << "env" << std::endl
+       << std::setw(16) << " " << jniEnvTimings.str(false) << std::endl
+       << "asgct broken" << std::endl
+       << std::setw(16) << " " << asgctBrokenTimings.str(false) << std::endl;
+    if (asgctErrors.count() > 0) {
+      ss << "asgct errors" << std::endl << asgctErrors.str();
+    }
+    return ss.str();
+  }
+};
+
+SampleStatistics platformThreadStats;
+SampleStatistics virtualThreadStats;
+
+/** number of samples without a reply from the signal handler in time */
+std::atomic<long> sampleTimeouts(0);
+
+/** number of samples where the mounted virtual thread changed while sampling */
+std::atomic<long> mountChangedDuringSample(0);
+
+SampleStatistics &statsFor(ThreadKind kind) {
+  return kind == ThreadKind::VIRTUAL ? virtualThreadStats : platformThreadStats;
+}
+
+/** number of successful samples since the last reset, readable without
+ * holding statsMutex */
+std::atomic<long> recordedSamples(0);
+
+long sampleCount() { return recordedSamples.load(); }
+
+/** histogram with exponentially growing buckets (four per power of two,
+ * starting at 2^MIN_EXPONENT), quantiles are approximated by the upper bound
+ * of the bucket */
+class LogHistogram {
+  static const int MIN_EXPONENT = -4; // ASGCT often takes less than 1µs
+  static const int BUCKETS = 96;
+  std::array<long, BUCKETS> counts{};
+  long _count = 0;
+  double _sum = 0;
+  float _max = 0;
+
+  static int bucket(float value) {
+    if (value < std::exp2(MIN_EXPONENT)) {
+      return 0;
+    }
+    return std::min(BUCKETS - 1,
+                    1 + (int)((std::log2(value) - MIN_EXPONENT) * 4));
+  }
+
+  static float upperBound(int bucket) {
+    return std::exp2(bucket / 4.0f + MIN_EXPONENT);
+  }
+
+public:
+  void push_back(float value) {
+    counts[bucket(value)]++;
+    _count++;
+    _sum += value;
+    _max = std::max(_max, value);
+  }
+
+  float quantile(float q) const {
+    long needed = std::max(1L, (long)std::ceil(q * _count));
+    long seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= needed) {
+        return std::min(upperBound(i), _max);
+      }
+    }
+    return _max;
+  }
+
+  long count() const { return _count; }
+
+  float mean() const { return _count == 0 ? 0 : _sum / _count; }
+
+  float max() const { return _max; }
+};
+
+// hold this mutex while modifying or reading the statistics
+std::mutex statsMutex;
+
+// hold this mutex while working with the outliers or ThreadRecord::thread
+std::mutex outlierMutex;
+
+/** histogram of stack depths with linear buckets of DEPTH_BUCKET_SIZE frames
+ * (like the bucket tables), quantiles are the lower bound of the bucket
+ * clamped to the observed minimum and maximum */
+class DepthHistogram {
+  static const int DEPTH_BUCKET_SIZE = 10;
+  static const int BUCKETS = MAX_DEPTH / DEPTH_BUCKET_SIZE + 1;
+  std::array<long, BUCKETS> counts{};
+  long _count = 0;
+  long _sum = 0;
+  long _min = 0;
+  long _max = 0;
+
+public:
+  void push_back(long depth) {
+    counts[std::min(depth / DEPTH_BUCKET_SIZE, (long)BUCKETS - 1)]++;
+    _min = _count == 0 ? depth : std::min(_min, depth);
+    _max = std::max(_max, depth);
+    _count++;
+    _sum += depth;
+  }
+
+  long quantile(float q) const {
+    long needed = std::max(1L, (long)std::ceil(q * _count));
+    long seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= needed) {
+        return std::max(_min, std::min((long)i * DEPTH_BUCKET_SIZE, _max));
+      }
+    }
+    return _max;
+  }
+
+  float mean() const { return _count == 0 ? 0 : (float)_sum / _count; }
+
+  long max() const { return _max; }
+};
+
+/** maximum number of threads that get their own statistics at the same time */
+const int MAX_THREAD_RECORDS = 2048;
+
+/** statistics of a single Java thread, only modified with statsMutex held */
+struct ThreadRecord {
+  std::atomic<bool> used{false}; // set after javaId and name are set
+  jlong javaId = 0;
+  char name[64] = {};
+  jthread thread = nullptr; // global ref while the thread is alive
+  // Java id of the mounted virtual thread, 0 if none (ids are positive)
+  std::atomic<jlong> mountedVirtualThread{0};
+  long attempts = 0;
+  long errors = 0;
+  LogHistogram asgctTimings;
+  DepthHistogram depths;
+
+  float errorRate() const {
+    return attempts == 0 ? 0 : errors * 100.0f / attempts;
+  }
+
+  void reset() {
+    attempts = 0;
+    errors = 0;
+    asgctTimings = LogHistogram();
+    depths = DepthHistogram();
+  }
+};
+
+std::array<ThreadRecord, MAX_THREAD_RECORDS> threadRecords;
+int usedThreadRecords = 0;    // only modified with statsMutex held
+long reusedThreadRecords = 0; // records of ended threads given to new ones
+long missingThreadRecords = 0; // threads without a record
+
+/** returns the ended thread's record with the fewest attempts or null,
+ * call with statsMutex and outlierMutex held */
+ThreadRecord *findReusableThreadRecord() {
+  ThreadRecord *result = nullptr;
+  for (auto &record : threadRecords) {
+    if (record.thread == nullptr &&
+        (result == nullptr || record.attempts < result->attempts)) {
+      result = &record;
+    }
+  }
+  return result;
+}
+
+/** returns a new record, reusing the record of an ended thread if all are
+ * used, or null if all threads are alive */
+ThreadRecord *allocateThreadRecord(JNIEnv *jni_env, jthread thread,
+                                   jlong javaId, const char *name) {
+  std::lock_guard<std::mutex> lock(statsMutex);
+  std::lock_guard<std::mutex> outlierLock(outlierMutex);
+  ThreadRecord *record = nullptr;
+  if (usedThreadRecords < MAX_THREAD_RECORDS) {
+    record = &threadRecords[usedThreadRecords++];
+  } else if ((record = findReusableThreadRecord()) != nullptr) {
+    reusedThreadRecords++;
+    record->reset();
+  } else {
+    missingThreadRecords++;
+    return nullptr;
+  }
+  record->javaId = javaId;
+  memset(record->name, 0, sizeof(record->name));
+  strncpy(record->name, name, sizeof(record->name) - 1);
+  record->thread = jni_env->NewGlobalRef(thread);
+  record->mountedVirtualThread = 0;
+  record->used = true;
+  return record;
+}
+
+void setMountedVirtualThread(jlong javaId) {
+  if (currentThreadRecord != nullptr) {
+    currentThreadRecord->mountedVirtualThread = javaId;
+  }
+}
+
+jlong mountedVirtualThread(ThreadRecord *record) {
+  if (!virtualThreadsEnabled || record == nullptr) {
+    return -1;
+  }
+  jlong javaId = record->mountedVirtualThread;
+  return javaId == 0 ? -1 : javaId;
+}
+
+/** prints the topThreads records with the largest key */
+template <typename Key>
+std::string topThreadsStr(const std::string &title, Key key) {
+  std::vector<ThreadRecord *> records;
+  for (auto &record : threadRecords) {
+    if (record.used && record.attempts > 0) {
+      records.push_back(&record);
+    }
+  }
+  size_t n = std::min(records.size(), (size_t)std::max(0, topThreads.load()));
+  if (n == 0) {
+    return "";
+  }
+  std::partial_sort(records.begin(), records.begin() + n, records.end(),
+                    [&](ThreadRecord *a, ThreadRecord *b) {
+                      return key(*a) > key(*b);
+                    });
+  std::stringstream ss;
+  ss << title << std::endl
+     << std::right << std::setw(7) << "id" << "  " << std::left
+     << std::setw(24) << "name" << printColumn("count", 12)
+     << printColumn("errors", 12) << printColumn("error%")
+     << printColumn("median") << printColumn("90th") << printColumn("99th")
+     << printColumn("max") << printColumn("depth avg", 11)
+     << printColumn("depth med", 11) << printColumn("depth 90th", 11)
+     << printColumn("depth max", 11) << std::endl;
+  for (size_t i = 0; i < n; i++) {
+    ThreadRecord &r = *records[i];
+    ss << std::right << std::setw(7) << r.javaId << "  " << std::left
+       << std::setw(24) << std::string(r.name).substr(0, 23)
+       << printColumn(r.attempts, 12) << printColumn(r.errors, 12)
+       << printColumn(r.errorRate()) << printColumn(r.asgctTimings.quantile(0.5))
+       << printColumn(r.asgctTimings.quantile(0.9))
+       << printColumn(r.asgctTimings.quantile(0.99))
+       << printColumn(r.asgctTimings.max()) << printColumn(r.depths.mean(), 11)
+       << printColumn(r.depths.quantile(0.5), 11)
+       << printColumn(r.depths.quantile(0.9), 11)
+       << printColumn(r.depths.max(), 11) << std::endl;
+  }
+  return ss.str();
+}
+
+/** per thread statistics, samples of virtual threads count for their carrier */
+std::string threadRecordsStr() {
+  std::stringstream ss;
+  ss << topThreadsStr("slowest threads // by 99th percentile of asgct alone",
+                      [](const ThreadRecord &r) {
+                        return r.asgctTimings.quantile(0.99);
+                      })
+     << std::endl
+     << topThreadsStr("most failing threads // by asgct error rate",
+                      [](const ThreadRecord &r) { return r.errorRate(); });
+  if (reusedThreadRecords > 0) {
+    ss << "statistics of ended threads dropped for new threads: "
+       << reusedThreadRecords << std::endl;
+  }
+  if (missingThreadRecords > 0) {
+    ss << "threads without statistics (more than " << MAX_THREAD_RECORDS
+       << " alive threads): " << missingThreadRecords << std::endl;
+  }
+  return ss.str();
+}
 
 ASGCT_CallTrace trace;
 ASGCT_CallFrame frames[MAX_DEPTH];
@@ -577,28 +1156,214 @@ std::atomic<float> timing;
 std::atomic<float> jniEnvTiming;
 std::atomic<long> traceLength;
 
-std::mutex printInfoMutex;
+/** number of samples before the 99th percentile is used as a threshold */
+const long OUTLIER_P99_MIN_SAMPLES = 1000;
+
+/** number of outliers kept in the ring buffer */
+const int OUTLIER_BUFFER_SIZE = 64;
+
+/** a sample whose time was above the outlier threshold */
+struct Outlier {
+  pthread_t thread;
+  jlong javaId;
+  char threadName[64];
+  jlong virtualThreadId; // mounted virtual thread before the signal or -1
+  jint threadState;      // after the sample finished, -1 if unknown
+  bool timedOut;         // no reply from the signal handler, no trace
+  long traceLength; // error code if <= 0
+  float envTime;
+  float asgctTime;
+  float totalTime; // signal handler till end
+  float threshold;
+  ASGCT_CallFrame frames[MAX_DEPTH];
+};
+
+std::array<Outlier, OUTLIER_BUFFER_SIZE> outliers;
+long outlierCount = 0; // number of captured outliers, including overwritten
+/** "signal handler till end" times of all samples, only modified with
+ * statsMutex held */
+LogHistogram signalHandlerTimes;
+
+/** records the time and returns the current outlier threshold (negative if
+ * there is none), call with statsMutex held */
+float recordOutlierThreshold(float totalTime) {
+  signalHandlerTimes.push_back(totalTime);
+  if (outlierThresholdIsP99) {
+    return signalHandlerTimes.count() >= OUTLIER_P99_MIN_SAMPLES
+               ? signalHandlerTimes.quantile(0.99)
+               : -1;
+  }
+  return outlierThresholdInUs;
+}
+
+/** copies the last sample of the thread into the outlier ring buffer, call
+ * with statsMutex held */
+void captureOutlier(pthread_t thread, ThreadRecord *record,
+                    jlong virtualThreadId, bool timedOut, float totalTime,
+                    float threshold) {
+  std::lock_guard<std::mutex> lock(outlierMutex);
+  jint state = -1;
+  if (record == nullptr || record->thread == nullptr ||
+      jvmti->GetThreadState(record->thread, &state) != JVMTI_ERROR_NONE) {
+    state = -1;
+  }
+  Outlier &outlier = outliers[outlierCount++ % OUTLIER_BUFFER_SIZE];
+  outlier.thread = thread;
+  outlier.javaId = record != nullptr ? record->javaId : -1;
+  strncpy(outlier.threadName, record != nullptr ? record->name : "",
+          sizeof(outlier.threadName));
+  outlier.virtualThreadId = virtualThreadId;
+  outlier.threadState = state;
+  outlier.timedOut = timedOut;
+  outlier.traceLength = timedOut ? 0 : traceLength.load();
+  outlier.envTime = jniEnvTiming;
+  outlier.asgctTime = timing;
+  outlier.totalTime = totalTime;
+  outlier.threshold = threshold;
+  if (!timedOut && outlier.traceLength > 0) {
+    std::copy(frames, frames + outlier.traceLength, outlier.frames);
+  }
+}
+
+/** returns "Lclass;.method" for the method id */
+std::string methodName(jmethodID method,
+                       std::unordered_map<jmethodID, std::string> &cache) {
+  auto it = cache.find(method);
+  if (it != cache.end()) {
+    return it->second;
+  }
+  std::string result = "<unknown method>";
+  jclass klass;
+  JvmtiDeallocator<char *> name;
+  JvmtiDeallocator<char *> signature;
+  if (method != nullptr &&
+      jvmti->GetMethodName(method, name.get_addr(), nullptr, nullptr) ==
+          JVMTI_ERROR_NONE &&
+      jvmti->GetMethodDeclaringClass(method, &klass) == JVMTI_ERROR_NONE) {
+    if (jvmti->GetClassSignature(klass, signature.get_addr(), nullptr) ==
+        JVMTI_ERROR_NONE) {
+      result = std::string(signature.get()) + "." + name.get();
+    }
+    JNIEnv *jni = nullptr;
+    jvm->GetEnv((void **)&jni, JNI_VERSION_1_6);
+    if (jni != nullptr) {
+      jni->DeleteLocalRef(klass);
+    }
+  }
+  cache[method] = result;
+  return result;
+}
 
-void printInfo() {
-  std::lock_guard<std::mutex> lock(printInfoMutex);
-  std::cerr << "asgct alone" << std::endl
-            << asgctTimings.str() << std::endl
-            << "signal handler till end" << std::endl
-            << asgctTimingsWithSignalHandling.str() << std::endl
-            << "env" << std::endl
-            << std::setw(16) << " " << jniEnvTimings.str(false) << std::endl
-            << "asgct broken" << std::endl
-            << std::setw(16) << " " << asgctBrokenTimings.str(false)
-            << std::endl;
+/** symbolizes the captured outliers, oldest first */
+std::string outliersStr() {
+  std::lock_guard<std::mutex> lock(outlierMutex);
+  if (outlierCount == 0) {
+    return "";
+  }
+  std::unordered_map<jmethodID, std::string> methodNames;
+  std::stringstream ss;
+  long first = std::max(0L, outlierCount - OUTLIER_BUFFER_SIZE);
+  ss << "outliers // last " << outlierCount - first << " of " << outlierCount
+     << " samples above the threshold (times in µs)" << std::endl;
+  for (long i = first; i < outlierCount; i++) {
+    Outlier &outlier = outliers[i % OUTLIER_BUFFER_SIZE];
+    ss << "total " << std::fixed << std::setprecision(2) << outlier.totalTime
+       << " (threshold " << outlier.threshold;
+    if (!outlier.timedOut) { // the phase timings of timeouts are unknown
+      ss << ", env " << outlier.envTime << ", asgct " << outlier.asgctTime;
+    }
+    ss << ") thread " << outlier.thread << " (Java id " << outlier.javaId << ", \"" << outlier.threadName
+       << "\")";
+    if (outlier.virtualThreadId != -1) {
+      ss << " running virtual thread (Java id " << outlier.virtualThreadId
+         << ")";
+    } else {
+      ss << " running platform thread";
+    }
+    ss << " state after sample ";
+    if (outlier.threadState == -1) {
+      ss << "unknown";
+    } else {
+      ss << "0x" << std::hex << outlier.threadState << std::dec;
+    }
+    if (outlier.timedOut) {
+      ss << " timeout (no reply from the signal handler)" << std::endl;
+      continue;
+    }
+    if (outlier.traceLength <= 0) {
+      ss << " error " << outlier.traceLength << std::endl;
+      continue;
+    }
+    ss << " depth " << outlier.traceLength << std::endl;
+    for (long j = 0; j < outlier.traceLength; j++) {
+      ASGCT_CallFrame &frame = outlier.frames[j];
+      ss << "    " << methodName(frame.method_id, methodNames) << " (bci "
+         << frame.lineno << ")" << std::endl;
+    }
+  }
+  return ss.str();
 }
 
+/** deletes the global reference to the ended thread, keeps the statistics */
+void releaseThreadRecord(JNIEnv *jni_env, ThreadRecord *record) {
+  std::lock_guard<std::mutex> lock(outlierMutex);
+  jni_env->DeleteGlobalRef(record->thread);
+  record->thread = nullptr;
+  record->mountedVirtualThread = 0;
+}
+
+void resetOutliers() {
+  std::lock_guard<std::mutex> lock(outlierMutex);
+  outlierCount = 0;
+  signalHandlerTimes = LogHistogram();
+}
+
+
+std::string infoStr() {
+  std::lock_guard<std::mutex> lock(statsMutex);
+  std::stringstream ss;
+  if (!virtualThreadsEnabled) {
+    ss << platformThreadStats.str();
+  } else {
+    ss << "=== platform threads (including idle carriers) ===" << std::endl
+       << platformThreadStats.str() << std::endl
+       << "=== virtual threads (mounted on a carrier) ===" << std::endl
+       << virtualThreadStats.str() << std::endl
+       << "mounted virtual thread changed during sample: "
+       << mountChangedDuringSample.load() << std::endl;
+  }
+  if (sampleTimeouts > 0) {
+    ss << "samples without reply from the signal handler within 1ms: "
+       << sampleTimeouts.load() << std::endl;
+  }
+  ss << std::endl << threadRecordsStr() << std::endl << outliersStr();
+  return ss.str();
+}
+
+void printInfo() { std::cerr << infoStr(); }
+
 std::atomic<long> lastInfoPrinted(0);
 
+/** resets all statistics, samples are either recorded before or after */
+void resetStats() {
+  std::lock_guard<std::mutex> lock(statsMutex);
+  platformThreadStats = SampleStatistics();
+  virtualThreadStats = SampleStatistics();
+  mountChangedDuringSample = 0;
+  sampleTimeouts = 0;
+  recordedSamples = 0;
+  lastInfoPrinted = 0;
+  for (auto &record : threadRecords) {
+    record.reset();
+  }
+  resetOutliers();
+}
+
 void printInfoIfNeeded() {
-  if (lastInfoPrinted.load() + (printStatsEveryNthTrace / 2) <
-      asgctTimings.count()) {
+  if (printStatsEveryNthTrace > 0 &&
+      lastInfoPrinted.load() + (printStatsEveryNthTrace / 2) < sampleCount()) {
     printInfo();
-    lastInfoPrinted = asgctTimings.count();
+    lastInfoPrinted = sampleCount();
   }
 }
 
@@ -626,7 +1391,10 @@ bool waitOnAtomicTillUnequal(std::atomic<long> &atomic, long expected = -1,
 }
 
 /** returns true if the obtaining of stack traces was successful */
-bool sample(pthread_t thread) {
+bool sample(pthread_t thread, ThreadRecord *record) {
+  jlong mountedBefore = mountedVirtualThread(record);
+  SampleStatistics &stats =
+      statsFor(mountedBefore == -1 ? ThreadKind::PLATFORM : ThreadKind::VIRTUAL);
   // send the signal
   auto start = std::chrono::steady_clock::now();
   traceLength = -100;
@@ -634,23 +1402,60 @@ bool sample(pthread_t thread) {
     fprintf(stderr, "could not send signal to thread %ld\n", thread);
     return false;
   }
-  if (!waitOnAtomicTillUnequal(traceLength, -100)) {
-    return false;
-  }
-  if (traceLength <= 0) {
-    asgctBrokenTimings.push_back(timing.load());
-    return false;
-  }
+  bool timedOut = !waitOnAtomicTillUnequal(traceLength, -100);
   auto end = std::chrono::steady_clock::now();
   auto duration =
       std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
           .count() / 1000.f;
-  asgctTimingsWithSignalHandling.push_back(traceLength.load(), duration);
-  asgctTimings.push_back(traceLength.load(), timing.load());
-  jniEnvTimings.push_back(jniEnvTiming.load());
+  std::unique_lock<std::mutex> lock(statsMutex);
+  if (timedOut) {
+    sampleTimeouts++;
+    // the slowest samples, so capture them in any case
+    float threshold = recordOutlierThreshold(duration);
+    if (threshold >= 0) {
+      captureOutlier(thread, record, mountedBefore, true, duration, threshold);
+    }
+    return false;
+  }
+  bool success = traceLength > 0;
+  if (virtualThreadsEnabled && mountedVirtualThread(record) != mountedBefore) {
+    // the carrier (un)mounted a virtual thread while we were sampling,
+    // we still attribute the sample to the kind seen before the signal
+    mountChangedDuringSample++;
+  }
+  if (record != nullptr) {
+    record->attempts++;
+  }
+  if (!success) {
+    stats.asgctBrokenTimings.push_back(timing.load());
+    stats.asgctErrors.push_back(traceLength.load());
+    if (record != nullptr) {
+      record->errors++;
+    }
+  } else {
+    if (record != nullptr) {
+      record->asgctTimings.push_back(timing.load());
+      record->depths.push_back(traceLength.load());
+    }
+    stats.asgctTimingsWithSignalHandling.push_back(traceLength.load(),
+                                                   duration);
+    stats.asgctTimings.push_back(traceLength.load(), timing.load());
+    stats.jniEnvTimings.push_back(jniEnvTiming.load());
+    recordedSamples++;
+  }
+  float threshold = recordOutlierThreshold(duration);
+  if (threshold >= 0 && duration > threshold) {
+    // capture with statsMutex held, so that a reset also removes it
+    captureOutlier(thread, record, mountedBefore, false, duration, threshold);
+  }
+  lock.unlock();
+
+  if (!success) {
+    return false;
+  }
 
   if (printStatsEveryNthTrace > 0 &&
-      asgctTimings.count() % printStatsEveryNthTrace == 0) {
+      sampleCount() % printStatsEveryNthTrace == 0) {
     printInfoIfNeeded();
   }
 
@@ -672,18 +1477,22 @@ void asgctGSTHandler(ucontext_t *ucontext) {
   trace.env_id = jni;
   trace.frames = frames;
   asgct(&trace, maxDepth, ucontext);
-  traceLength = trace.num_frames;
   timing = std::chrono::duration_cast<std::chrono::nanoseconds>(
                std::chrono::steady_clock::now() - start)
                .count() / 1000.0f;
+  // set last, the sampler thread reads the other values after it changed
+  traceLength = trace.num_frames;
 }
 
 void sample(std::mt19937 &g) {
-  std::vector<pthread_t> avThreads;
+  std::vector<std::pair<pthread_t, ThreadRecord *>> avThreads;
   {
     std::lock_guard<std::recursive_mutex> lock(threadToJavaIdMutex);
     for (auto &pair : threadToJavaId) {
-      avThreads.push_back(pair.first);
+      auto record = threadToRecord.find(pair.first);
+      avThreads.emplace_back(pair.first, record == threadToRecord.end()
+                                             ? nullptr
+                                             : record->second);
     }
   }
   if (avThreads.empty()) {
@@ -692,9 +1501,9 @@ void sample(std::mt19937 &g) {
   std::shuffle(avThreads.begin(), avThreads.end(), g);
   if (checkThreadRunning) {
     int count = 0;
-    for (auto thread : avThreads) {
+    for (auto [thread, record] : avThreads) {
       auto javaThread = getJThreadForPThread(env, thread);
-      if (!javaThread || !checkJThread(javaThread) || !sample(thread)) {
+      if (!javaThread || !checkJThread(javaThread) || !sample(thread, record)) {
         continue;
       }
       if (++count >= threadsPerInterval) {
@@ -703,8 +1512,8 @@ void sample(std::mt19937 &g) {
     }
   } else {
     int count = 0;
-    for (auto thread : avThreads) {
-      if (!sample(thread)) {
+    for (auto [thread, record] : avThreads) {
+      if (!sample(thread, record)) {
         continue;
       }
       if (++count >= threadsPerInterval) {
@@ -729,11 +1538,15 @@ void sampleLoop() {
   setpriority(PRIO_PROCESS, 0,
               0); // try to make the priority of this thread higher
 
-  std::chrono::microseconds interval{sampleIntervalInUs};
   while (!shouldStop) {
     if (env == nullptr) {
       env = newEnv;
     }
+    if (paused) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+    std::chrono::microseconds interval{sampleIntervalInUs};
     auto start = std::chrono::steady_clock::now();
     sample(g);
     auto duration = std::chrono::steady_clock::now() - start;
@@ -743,3 +1556,199 @@ void sampleLoop() {
     }
   }
 }
+
+const char *CONTROL_HELP = R"(Commands (one per line):
+  set <option>=<value>  change maxDepth, printStatsEveryNthTrace,
+                        sampleIntervalInUs, threadsPerInterval, topThreads
+                        or outlierThreshold
+  get                   print the current runtime options
+  pause                 stop sampling
+  resume                resume sampling
+  reset                 reset all statistics
+  report                print the statistics
+  help                  print this help
+)";
+
+/** executes a single command from the control socket, returns the reply */
+std::string handleControlCommand(const std::string &line) {
+  std::string command = line.substr(0, line.find(' '));
+  std::string argument =
+      command.size() < line.size() ? line.substr(command.size() + 1) : "";
+  std::stringstream ss;
+  if (command == "set") {
+    auto equalsPos = argument.find("=");
+    std::string key = argument.substr(0, equalsPos);
+    if (equalsPos == std::string::npos || !isRuntimeOption(key) ||
+        !setOption(key, argument.substr(equalsPos + 1))) {
+      return "error: invalid option " + argument + "\n";
+    }
+  } else if (command == "get") {
+    ss << "maxDepth=" << maxDepth << std::endl
+       << "printStatsEveryNthTrace=" << printStatsEveryNthTrace << std::endl
+       << "sampleIntervalInUs=" << sampleIntervalInUs << std::endl
+       << "threadsPerInterval=" << threadsPerInterval << std::endl
+       << "topThreads=" << topThreads << std::endl
+       << "outlierThreshold="
+       << (outlierThresholdIsP99     ? "p99"
+           : outlierThresholdInUs < 0 ? "off"
+                                      : std::to_string(outlierThresholdInUs))
+       << std::endl
+       << "paused=" << (paused ? "true" : "false") << std::endl;
+  } else if (command == "pause") {
+    paused = true;
+  } else if (command == "resume") {
+    paused = false;
+  } else if (command == "reset") {
+    resetStats();
+  } else if (command == "report") {
+    ss << infoStr();
+  } else if (command == "help") {
+    ss << CONTROL_HELP;
+  } else {
+    return "error: unknown command " + command + "\n";
+  }
+  ss << "ok" << std::endl;
+  return ss.str();
+}
+
+/** clients have to send a complete request within this time */
+const int CONTROL_CONNECTION_TIMEOUT_MS = 1000;
+
+/** waits till the file descriptor is readable, returns false on stop or
+ * after timeoutMs (negative: no timeout) */
+bool pollTillReadable(int fd, int timeoutMs = -1) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  auto start = std::chrono::steady_clock::now();
+  while (!shouldStop) {
+    if (timeoutMs >= 0 && std::chrono::steady_clock::now() - start >
+                              std::chrono::milliseconds(timeoutMs)) {
+      return false;
+    }
+    int res = poll(&pfd, 1, 100);
+    if (res > 0) {
+      return true;
+    }
+    if (res < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+  return false;
+}
+
+/** executes the command and sends the reply, returns false on error */
+bool replyToControlCommand(int client, std::string line) {
+  if (!line.empty() && line.back() == '\r') {
+    line.pop_back();
+  }
+  if (line.empty()) {
+    return true;
+  }
+  std::string reply = handleControlCommand(line);
+#ifdef MSG_NOSIGNAL
+  int flags = MSG_NOSIGNAL; // don't kill the JVM if the client is gone
+#else
+  int flags = 0;
+#endif
+  return send(client, reply.c_str(), reply.size(), flags) >= 0;
+}
+
+/** reads commands line by line from the client, closes the connection after
+ * replying to all complete lines of a request, at the end of the input or
+ * after CONTROL_CONNECTION_TIMEOUT_MS (so that clients that keep the
+ * connection open do not block other clients) */
+void handleControlConnection(int client) {
+  std::string buffer;
+  char chunk[256];
+  while (pollTillReadable(client, CONTROL_CONNECTION_TIMEOUT_MS)) {
+    ssize_t read = recv(client, chunk, sizeof(chunk), 0);
+    if (read < 0) {
+      return;
+    }
+    if (read == 0) { // end of input, execute a last line without newline
+      replyToControlCommand(client, buffer);
+      return;
+    }
+    buffer.append(chunk, read);
+    size_t newlinePos;
+    while ((newlinePos = buffer.find('\n')) != std::string::npos) {
+      std::string line = buffer.substr(0, newlinePos);
+      buffer.erase(0, newlinePos + 1);
+      if (!replyToControlCommand(client, line)) {
+        return;
+      }
+    }
+    if (buffer.empty()) {
+      return;
+    }
+  }
+}
+
+/** returns true if the path does not exist or is a stale socket that could
+ * be removed, false if it is another file or a socket still in use */
+bool removeStaleControlSocket(const struct sockaddr_un &addr) {
+  struct stat st;
+  if (lstat(addr.sun_path, &st) != 0) {
+    return errno == ENOENT;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    fprintf(stderr, "Control socket path exists and is not a socket: %s\n",
+            addr.sun_path);
+    return false;
+  }
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  bool inUse =
+      probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  if (probe >= 0) {
+    close(probe);
+  }
+  if (inUse) {
+    fprintf(stderr, "Control socket is used by another process: %s\n",
+            addr.sun_path);
+    return false;
+  }
+  return unlink(addr.sun_path) == 0;
+}
+
+void controlLoop() {
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) {
+    perror("Could not create control socket");
+    return;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (controlSocketPath.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Control socket path too long: %s\n",
+            controlSocketPath.c_str());
+    close(server);
+    return;
+  }
+  strncpy(addr.sun_path, controlSocketPath.c_str(), sizeof(addr.sun_path) - 1);
+  if (!removeStaleControlSocket(addr)) {
+    close(server);
+    return;
+  }
+  if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(server, 1) < 0) {
+    perror("Could not bind control socket");
+    close(server);
+    return;
+  }
+  // attach only now, as attaching registers the thread as a sampling target
+  JNIEnv *newEnv;
+  jvm->AttachCurrentThreadAsDaemon(
+      (void **)&newEnv,
+      nullptr); // needed to symbolize the outliers in the report
+  while (pollTillReadable(server)) {
+    int client = accept(server, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    }
+    handleControlConnection(client);
+    close(client);
+  }
+  close(server);
+  unlink(controlSocketPath.c_str());
+  jvm->DetachCurrentThread(); // removes the thread from the sampling targets
+}